@@ -0,0 +1,1005 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "libtransplant.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/*
+ * The same restrictions as in transplant.c apply here: no array brackets, no
+ * arrays, no malloc() and no floating point.  The library allocates nothing:
+ * all the storage it uses is supplied by the caller through the context.
+ * Where that storage comes from is up to the caller; the command-line program
+ * maps its io buffer under the exception stated in transplant.c.
+ */
+
+/*
+ * Size of the fixed part of a DIRECTORY_ENTRY record following the header:
+ * 4 bytes of mode and 8 bytes of size.
+ */
+#define ENTRY_METADATA_SIZE 12
+
+/*
+ * Prefix of the name of the temporary file that replaces an existing file
+ * atomically in TRANSPLANT_DURABLE_STRICT mode.
+ */
+#define TEMP_PREFIX ".transplant."
+
+/*
+ * Number of temporary names tried before giving up, when the previous ones
+ * already exist.
+ */
+#define TEMP_ATTEMPTS 100
+
+/*
+ * @brief Checks whether a directory entry name is "." or "..".
+ * @return 1 if it is, 0 otherwise.
+ */
+static int is_dot_entry(char *name) {
+    if(*name != '.'){
+        return 0;
+    }
+    return *(name+1) == '\0' || (*(name+1) == '.' && *(name+2) == '\0');
+}
+
+/*
+ * @brief Write the staged output to the sink.
+ * @details The io buffer holds io_len bytes of output that have not yet been
+ * handed to the sink.  They are passed on, retrying short writes, and the
+ * buffer is emptied.
+ * @return 0 in case of success, -1 if the sink fails.
+ */
+static int flush_output(struct transplant_ctx *ctx) {
+    struct iovec iov;
+    size_t done = 0;
+    ssize_t n;
+
+    while(done < ctx->io_len){
+        iov.iov_base = ctx->io_buf + done;
+        iov.iov_len = ctx->io_len - done;
+        n = ctx->sink(ctx->io_arg, &iov, 1);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            return -1;
+        }
+        done += n;
+    }
+    ctx->io_len = 0;
+    return 0;
+}
+
+/*
+ * @brief Append one byte to the staged output, flushing when the buffer is full.
+ * @return 0 in case of success, -1 if the sink fails.
+ */
+static int put_byte(struct transplant_ctx *ctx, int c) {
+    if(ctx->io_len == ctx->io_size && flush_output(ctx)){
+        return -1;
+    }
+    *(ctx->io_buf + ctx->io_len) = c;
+    ctx->io_len++;
+    return 0;
+}
+
+/*
+ * @brief Append a big-endian number of the given width to the staged output.
+ * @return 0 in case of success, -1 if the sink fails.
+ */
+static int put_number(struct transplant_ctx *ctx, uint64_t value, int bytes) {
+    while(bytes > 0){
+        bytes--;
+        if(put_byte(ctx, (value >> (8 * bytes)) & 0xFF)){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief Append the 16 byte header of a record to the staged output.
+ * @return 0 in case of success, -1 if the sink fails.
+ */
+static int put_header(struct transplant_ctx *ctx, int type, uint32_t depth, uint64_t size) {
+    if(put_byte(ctx, TRANSPLANT_MAGIC0) || put_byte(ctx, TRANSPLANT_MAGIC1)
+        || put_byte(ctx, TRANSPLANT_MAGIC2) || put_byte(ctx, type)){
+        return -1;
+    }
+    if(put_number(ctx, depth, 4) || put_number(ctx, size, 8)){
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief Refill the io buffer from the source.
+ * @details This function must only be called once all buffered input has
+ * been consumed.
+ * @return 0 in case of success, -1 at end of input or if the source fails.
+ */
+static int fill_input(struct transplant_ctx *ctx) {
+    struct iovec iov;
+    ssize_t n;
+
+    iov.iov_base = ctx->io_buf;
+    iov.iov_len = ctx->io_size;
+    do{
+        n = ctx->source(ctx->io_arg, &iov, 1);
+    }while(n < 0 && errno == EINTR);
+    if(n <= 0){
+        return -1;
+    }
+    ctx->io_pos = 0;
+    ctx->io_len = n;
+    return 0;
+}
+
+/*
+ * @brief Read one byte of input.
+ * @return the byte read, or -1 at end of input or if the source fails.
+ */
+static int get_byte(struct transplant_ctx *ctx) {
+    if(ctx->io_pos == ctx->io_len && fill_input(ctx)){
+        return -1;
+    }
+    ctx->io_pos++;
+    return (unsigned char) *(ctx->io_buf + ctx->io_pos - 1);
+}
+
+/*
+ * @brief Read a big-endian number of the given width.
+ * @return 0 in case of success, -1 if the input ends early.
+ */
+static int get_number(struct transplant_ctx *ctx, int bytes, uint64_t *value) {
+    int c;
+    *value = 0;
+    while(bytes > 0){
+        if((c = get_byte(ctx)) < 0){
+            return -1;
+        }
+        *value = (*value << 8) | c;
+        bytes--;
+    }
+    return 0;
+}
+
+/*
+ * @brief Read the 16 byte header of a record.
+ * @return 0 in case of success, -1 if the magic bytes do not match or the
+ * input ends early.
+ */
+static int get_header(struct transplant_ctx *ctx, int *type, uint32_t *depth, uint64_t *size) {
+    uint64_t value;
+    if(get_byte(ctx) != TRANSPLANT_MAGIC0 || get_byte(ctx) != TRANSPLANT_MAGIC1
+        || get_byte(ctx) != TRANSPLANT_MAGIC2){
+        return -1;
+    }
+    if((*type = get_byte(ctx)) < 0 || get_number(ctx, 4, &value)){
+        return -1;
+    }
+    *depth = value;
+    return get_number(ctx, 8, size);
+}
+
+/*
+ * @brief Decide whether the current shard carries a regular file.
+ * @details  Files are considered in traversal order.  A file belongs to the
+ * shard whose slice of the total data bytes contains the middle of the file,
+ * so that a large file leading a slice does not drag the files after it into
+ * the same shard.  Empty files at the very end go to the last shard.
+ * Outside of a sharded run every file is carried.
+ *
+ * @param size  The size of the file being considered.
+ * @return 1 if the file is to be serialized with this context, 0 otherwise.
+ */
+static int shard_owns(struct transplant_ctx *ctx, off_t size) {
+    uint64_t owner = 0;
+    if(ctx->shard_index < 0){
+        return 1;
+    }
+    if(ctx->shard_total){
+        owner = (ctx->shard_offset + size / 2) * ctx->shard_count / ctx->shard_total;
+    }
+    if(owner >= (uint64_t) ctx->shard_count){
+        owner = ctx->shard_count - 1;
+    }
+    ctx->shard_offset += size;
+    return owner == (uint64_t) ctx->shard_index;
+}
+
+/*
+ * @brief Read the monotonic clock, for timing sync calls.
+ * @return the current time in nanoseconds.
+ */
+static uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * @brief Return the offset in path_buf of the last component of the path.
+ */
+static int last_component(struct transplant_ctx *ctx) {
+    int i = ctx->path_length;
+    while(i > 0 && *(ctx->path_buf+i-1) != '/'){
+        i--;
+    }
+    return i;
+}
+
+/*
+ * @brief Open the directory that contains the file named by the path.
+ * @details  The directory is named by the path cut off right after its last
+ * separator; a path without one is relative to the current directory.
+ * @return a descriptor for the directory, AT_FDCWD, or -1 in case of error.
+ */
+static int open_parent(struct transplant_ctx *ctx) {
+    int start = last_component(ctx);
+    int dir;
+    char c;
+    if(!start){
+        return AT_FDCWD;
+    }
+    c = *(ctx->path_buf+start);
+    *(ctx->path_buf+start) = '\0';
+    dir = open(ctx->path_buf, O_RDONLY | O_DIRECTORY);
+    *(ctx->path_buf+start) = c;
+    return dir;
+}
+
+/*
+ * @brief Build a name for the temporary file that replaces the file named by
+ * the path.
+ * @details  The name is stored in path_buf right after the terminating null
+ * byte of the path, so that both names are at hand for the rename.  It is
+ * TEMP_PREFIX followed by the inode number of the file being replaced and the
+ * attempt number, which is always well within NAME_MAX.  The name may still
+ * exist, for example as an entry of the archive, so the caller must create
+ * the file with O_EXCL and try the next attempt if it does.
+ *
+ * @param ino  The inode number of the file being replaced.
+ * @param attempt  The number of names already tried.
+ * @return the name, relative to the directory of the file, or NULL if it does
+ * not fit in path_buf.
+ */
+static char *temp_name(struct transplant_ctx *ctx, ino_t ino, int attempt) {
+    size_t length = ctx->path_length;
+    size_t room = ctx->path_size - length - 1;
+    char *temp = ctx->path_buf + length + 1;
+    int n;
+
+    n = snprintf(temp, room, "%s%lu.%d", TEMP_PREFIX, (unsigned long) ino, attempt);
+    if(n < 0 || (size_t) n >= room){
+        return NULL;
+    }
+    return temp;
+}
+
+/*
+ * @brief Complete a deserialized file according to the durability mode.
+ * @details  The mode of the file is set if it differs from the one the file
+ * has, writeback is started (batched) or waited for (strict), and the file is
+ * closed.  A new file is created with its mode, so the mode only needs to be
+ * changed when the umask cleared some of its bits or when an existing file
+ * was overwritten in place.  In strict mode the file is fdatasync()ed, or
+ * fsync()ed if its mode was changed, since fdatasync() does not flush a mode
+ * changed after creation.  If the file is a temporary file replacing an
+ * existing one, it is then renamed over it; if anything failed the temporary
+ * file is removed instead.
+ *
+ * @param fd  The descriptor of the file, which is closed.
+ * @param mode  The mode from the DIRECTORY_ENTRY record, or 0 to leave the
+ * mode the file was created with.
+ * @param dir  The directory of the file, which is closed, if temp is not NULL.
+ * @param temp  The name of the temporary file in dir, or NULL if the file was
+ * written in place.
+ * @return 0 in case of success, -1 otherwise.
+ */
+static int finish_file(struct transplant_ctx *ctx, int fd, mode_t mode, int dir, char *temp) {
+    struct stat stat_buf;
+    int ret = 0;
+    int chmodded = 0;
+    uint64_t time;
+
+    if(mode && (fstat(fd, &stat_buf) || (stat_buf.st_mode & 0777) != (mode & 0777))){
+        ret = fchmod(fd, mode & 0777);
+        chmodded = 1;
+    }
+    time = now_nsec();
+    if(ctx->durability == TRANSPLANT_DURABLE_BATCHED){
+        ret |= sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        ctx->stats.writebacks++;
+    }else if(ctx->durability == TRANSPLANT_DURABLE_STRICT && chmodded){
+        ret |= fsync(fd);
+        ctx->stats.fsyncs++;
+    }else if(ctx->durability == TRANSPLANT_DURABLE_STRICT){
+        ret |= fdatasync(fd);
+        ctx->stats.fdatasyncs++;
+    }
+    ctx->stats.sync_nsec += now_nsec() - time;
+    if(close(fd)){
+        ret = -1;
+    }
+    if(temp == NULL){
+        return ret ? -1 : 0;
+    }
+
+    if(!ret && !renameat(dir, temp, dir, ctx->path_buf + last_component(ctx))){
+        ctx->stats.renames++;
+    }else{
+        unlinkat(dir, temp, 0);
+        ret = -1;
+    }
+    if(dir >= 0){
+        close(dir);
+    }
+    return ret ? -1 : 0;
+}
+
+/*
+ * @brief Make the entries of a deserialized directory durable.
+ * @details  Called at END_OF_DIRECTORY with the path naming the directory.
+ * In batched mode a single syncfs() covers every file whose writeback was
+ * started since the last one, and the directory entries.  In strict mode the
+ * files are already on disk and the directory itself is fsync()ed.  Nothing
+ * is done if there is nothing new to sync.
+ *
+ * @param changed  The number of entries of this directory that were written.
+ * @return 0 in case of success, -1 otherwise.
+ */
+static int sync_directory(struct transplant_ctx *ctx, int changed) {
+    int ret;
+    int dir;
+    uint64_t time;
+
+    if(ctx->durability == TRANSPLANT_DURABLE_NONE
+        || (ctx->durability == TRANSPLANT_DURABLE_BATCHED && !ctx->unsynced)
+        || (ctx->durability == TRANSPLANT_DURABLE_STRICT && !changed)){
+        return 0;
+    }
+    dir = open(ctx->path_buf, O_RDONLY | O_DIRECTORY);
+    if(dir < 0){
+        return -1;
+    }
+    time = now_nsec();
+    if(ctx->durability == TRANSPLANT_DURABLE_BATCHED){
+        ret = syncfs(dir);
+        ctx->stats.syncfs++;
+        ctx->unsynced = 0;
+    }else{
+        ret = fsync(dir);
+        ctx->stats.directory_fsyncs++;
+    }
+    ctx->stats.sync_nsec += now_nsec() - time;
+    if(close(dir)){
+        ret = -1;
+    }
+    return ret ? -1 : 0;
+}
+
+/*
+ * @brief Initialize a context with caller-supplied storage.
+ * @details  path_buf receives the pathname of the file or directory being
+ * processed, name_buf the name of the entry being deserialized, and io_buf
+ * stages serialized data on its way to the sink or from the source.  A larger
+ * io buffer means fewer, larger callbacks.  The context starts with an empty
+ * path, no options and no sharding; the caller then sets the source and/or
+ * sink, io_arg and options, and the pathname with transplant_path_init().
+ *
+ * @return 0 in case of success, -1 if a buffer is too small.
+ */
+int transplant_init(struct transplant_ctx *ctx, char *path_buf, size_t path_size,
+    char *name_buf, size_t name_size, char *io_buf, size_t io_size) {
+    if(path_size < 2 || name_size < 2 || io_size < TRANSPLANT_IO_MIN){
+        return -1;
+    }
+    ctx->path_buf = path_buf;
+    ctx->path_size = path_size;
+    ctx->path_length = 0;
+    *path_buf = '\0';
+    ctx->name_buf = name_buf;
+    ctx->name_size = name_size;
+    *name_buf = '\0';
+    ctx->io_buf = io_buf;
+    ctx->io_size = io_size;
+    ctx->io_pos = 0;
+    ctx->io_len = 0;
+    ctx->options = 0;
+    ctx->source = NULL;
+    ctx->sink = NULL;
+    ctx->skip = NULL;
+    ctx->io_arg = NULL;
+    ctx->shard_count = 0;
+    ctx->shard_index = -1;
+    ctx->shard_total = 0;
+    ctx->shard_offset = 0;
+    ctx->shard_fixup = 0;
+    ctx->durability = TRANSPLANT_DURABLE_NONE;
+    ctx->stats.files = 0;
+    ctx->stats.directories = 0;
+    ctx->stats.bytes = 0;
+    ctx->stats.writebacks = 0;
+    ctx->stats.fdatasyncs = 0;
+    ctx->stats.fsyncs = 0;
+    ctx->stats.syncfs = 0;
+    ctx->stats.directory_fsyncs = 0;
+    ctx->stats.renames = 0;
+    ctx->stats.sync_nsec = 0;
+    ctx->unsynced = 0;
+    return 0;
+}
+
+/*
+ * @brief  Initialize the path of a context to a specified base path.
+ * @details  The argument string, including its terminating null byte, is
+ * copied into path_buf and path_length is set to its length.
+ *
+ * @param  Pathname to be copied into path_buf.
+ * @return 0 in case of success, -1 if the pathname does not fit, in which
+ * case the path is left empty.
+ */
+int transplant_path_init(struct transplant_ctx *ctx, char *name) {
+    size_t i = 0;
+    while(*(name+i) != '\0'){
+        if(i+1 >= ctx->path_size){
+            *ctx->path_buf = '\0';
+            ctx->path_length = 0;
+            return -1;
+        }
+        *(ctx->path_buf+i) = *(name+i);
+        i++;
+    }
+    *(ctx->path_buf+i) = '\0';
+    ctx->path_length = i;
+    return 0;
+}
+
+/*
+ * @brief  Append a component to the path of a context.
+ * @details  The path separator character '/' is added unless the path is
+ * empty or already ends with one, followed by the argument string.  An empty
+ * argument leaves the path unchanged.
+ *
+ * @param  The string to be appended.  It must not contain '/'.
+ * @return 0 in case of success, -1 if the string contains '/' or the result
+ * does not fit, in which case the path is left unchanged.
+ */
+int transplant_path_push(struct transplant_ctx *ctx, char *name) {
+    size_t length = ctx->path_length;
+    size_t i = 0;
+    int separator = length > 0 && *(ctx->path_buf+length-1) != '/';
+
+    while(*(name+i) != '\0'){
+        if(*(name+i) == '/'){
+            return -1;
+        }
+        i++;
+    }
+    if(!i){
+        return 0;
+    }
+    if(length + separator + i + 1 > ctx->path_size){
+        return -1;
+    }
+
+    if(separator){
+        *(ctx->path_buf+length) = '/';
+        length++;
+    }
+    i = 0;
+    while(*(name+i) != '\0'){
+        *(ctx->path_buf+length) = *(name+i);
+        length++;
+        i++;
+    }
+    *(ctx->path_buf+length) = '\0';
+    ctx->path_length = length;
+    return 0;
+}
+
+/*
+ * @brief  Remove the last component from the path of a context.
+ * @details  The suffix that starts at the last occurrence of '/' is removed;
+ * if there is none the path becomes empty.
+ *
+ * @return 0 in case of success, -1 if the path is already empty.
+ */
+int transplant_path_pop(struct transplant_ctx *ctx) {
+    int length = ctx->path_length;
+    if(!length){
+        return -1;
+    }
+    while(length > 0 && *(ctx->path_buf+length-1) != '/'){
+        length--;
+    }
+    if(length > 0){
+        length--;
+    }
+    *(ctx->path_buf+length) = '\0';
+    ctx->path_length = length;
+    return 0;
+}
+
+/*
+ * @brief Hand all staged output to the sink.
+ * @details  Serialization stages output in the io buffer and only passes it
+ * on when the buffer fills up, so this must be called once the records of
+ * interest have been produced.  transplant_serialize() does so itself.
+ *
+ * @return 0 in case of success, -1 if the sink fails.
+ */
+int transplant_flush(struct transplant_ctx *ctx) {
+    return flush_output(ctx);
+}
+
+/*
+ * @brief  Serialize the contents of a file as a single FILE_DATA record.
+ * @details  The file named by the path of the context is read directly into
+ * the io buffer, behind any record headers already staged there, and handed
+ * to the sink from there.
+ *
+ * @param depth  The value to be used in the depth field of the FILE_DATA record.
+ * @param size  The number of bytes of data in the file to be serialized.
+ * @return 0 in case of success, -1 otherwise.  Errors include failure to open
+ * the file, the file holding fewer than size bytes, and I/O errors reading the
+ * file or writing to the sink.
+ */
+int transplant_serialize_file(struct transplant_ctx *ctx, int depth, off_t size) {
+    uint64_t remaining = size;
+    size_t room;
+    ssize_t n;
+    int fd = open(ctx->path_buf, O_RDONLY);
+    if(fd < 0){
+        return -1;
+    }
+
+    if(put_header(ctx, TRANSPLANT_FILE_DATA, depth, remaining + TRANSPLANT_HEADER_SIZE)){
+        close(fd);
+        return -1;
+    }
+    while(remaining > 0){
+        if(ctx->io_len == ctx->io_size && flush_output(ctx)){
+            close(fd);
+            return -1;
+        }
+        room = ctx->io_size - ctx->io_len;
+        if(room > remaining){
+            room = remaining;
+        }
+        n = read(fd, ctx->io_buf + ctx->io_len, room);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            close(fd);
+            return -1;
+        }
+        ctx->io_len += n;
+        remaining -= n;
+    }
+    ctx->stats.files++;
+    ctx->stats.bytes += size;
+    return close(fd) ? -1 : 0;
+}
+
+/*
+ * @brief  Serialize the contents of a directory.
+ * @details  The directory named by the path of the context is serialized as
+ * a START_OF_DIRECTORY record, a DIRECTORY_ENTRY record for each entry, each
+ * followed by the FILE_DATA record of a regular file or the records of a
+ * subdirectory at depth+1, and an END_OF_DIRECTORY record.  When sharding,
+ * regular files that belong to other shards are left out.
+ *
+ * @param depth  The value of the depth field of the top-level records.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int transplant_serialize_directory(struct transplant_ctx *ctx, int depth) {
+    struct stat stat_buf;
+    struct dirent *de;
+    uint64_t name_length;
+    char *name;
+    int exit = 0;
+    DIR *dir = opendir(ctx->path_buf);
+    if(dir == NULL){
+        return -1;
+    }
+
+    if(put_header(ctx, TRANSPLANT_START_OF_DIRECTORY, depth, TRANSPLANT_HEADER_SIZE)){
+        closedir(dir);
+        return -1;
+    }
+    ctx->stats.directories++;
+
+    errno = 0;
+    while(!exit && (de = readdir(dir)) != NULL){
+        name = de->d_name;
+        if(is_dot_entry(name)){
+            continue;
+        }
+        if(transplant_path_push(ctx, name) || stat(ctx->path_buf, &stat_buf)){
+            exit = -1;
+            break;
+        }
+
+        //Skipping files that belong to another shard
+        if(S_ISREG(stat_buf.st_mode) && !shard_owns(ctx, stat_buf.st_size)){
+            transplant_path_pop(ctx);
+            errno = 0;
+            continue;
+        }
+
+        name_length = 0;
+        while(*(name+name_length) != '\0'){
+            name_length++;
+        }
+        exit = put_header(ctx, TRANSPLANT_DIRECTORY_ENTRY, depth,
+            TRANSPLANT_HEADER_SIZE + ENTRY_METADATA_SIZE + name_length);
+        exit = exit || put_number(ctx, stat_buf.st_mode, 4) || put_number(ctx, stat_buf.st_size, 8);
+        while(!exit && *name != '\0'){
+            exit = put_byte(ctx, *name);
+            name++;
+        }
+
+        if(!exit && S_ISREG(stat_buf.st_mode)){
+            exit = transplant_serialize_file(ctx, depth, stat_buf.st_size);
+        }else if(!exit && S_ISDIR(stat_buf.st_mode)){
+            exit = transplant_serialize_directory(ctx, depth+1);
+        }
+        transplant_path_pop(ctx);
+        errno = 0;
+    }
+    if(!exit && errno){
+        exit = -1;
+    }
+    closedir(dir);
+    if(exit){
+        return -1;
+    }
+
+    return put_header(ctx, TRANSPLANT_END_OF_DIRECTORY, depth, TRANSPLANT_HEADER_SIZE);
+}
+
+/*
+ * @brief Serialize the tree of files and directories named by the path of a
+ * context to its sink.
+ * @details  The contents of the directory (not the directory itself) are
+ * emitted between a START_OF_TRANSMISSION and an END_OF_TRANSMISSION record,
+ * and all staged output is flushed to the sink before returning.
+ *
+ * @return 0 in case of success, -1 otherwise.
+ */
+int transplant_serialize(struct transplant_ctx *ctx) {
+    if(put_header(ctx, TRANSPLANT_START_OF_TRANSMISSION, 0, TRANSPLANT_HEADER_SIZE)){
+        return -1;
+    }
+    if(transplant_serialize_directory(ctx, 1)){
+        return -1;
+    }
+    if(put_header(ctx, TRANSPLANT_END_OF_TRANSMISSION, 0, TRANSPLANT_HEADER_SIZE)){
+        return -1;
+    }
+    return flush_output(ctx);
+}
+
+/*
+ * @brief Deserialize the contents of a single file.
+ * @details  A FILE_DATA record is read from the source and its content is
+ * written to the file named by the path of the context, straight out of the
+ * io buffer, then completed according to the durability mode of the context.
+ * In strict mode an existing file is replaced atomically through a temporary
+ * file.  The caller is responsible for the clobber check.  When replaying a
+ * shard to fix up directory modes, the content is skipped, with the skip
+ * callback if the context has one.
+ *
+ * @param depth  The value of the depth field expected in the FILE_DATA record.
+ * @param mode  The mode from the DIRECTORY_ENTRY record, or 0 to leave the
+ * mode the file is created with.
+ * @return 0 in case of success, -1 otherwise.  Errors include a record that
+ * is not FILE_DATA or has the wrong depth, and I/O errors reading from the
+ * source or creating the file.
+ */
+int transplant_deserialize_file(struct transplant_ctx *ctx, int depth, mode_t mode) {
+    struct stat stat_buf;
+    int type;
+    uint32_t record_depth;
+    uint64_t size;
+    size_t n;
+    ssize_t written;
+    int fd = -1;
+    int dir = AT_FDCWD;
+    char *temp = NULL;
+    mode_t create_mode = mode ? mode & 0777 : 0666;
+
+    if(get_header(ctx, &type, &record_depth, &size)){
+        return -1;
+    }
+    if(type != TRANSPLANT_FILE_DATA || record_depth != (uint32_t) depth || size < TRANSPLANT_HEADER_SIZE){
+        return -1;
+    }
+    size -= TRANSPLANT_HEADER_SIZE;
+
+    //The file was already written by its shard, only its record is skipped
+    if(!ctx->shard_fixup){
+        //Replacing an existing file atomically through a temporary file, which
+        //must be a new file: any existing name may belong to the tree itself
+        if(ctx->durability == TRANSPLANT_DURABLE_STRICT && !lstat(ctx->path_buf, &stat_buf)){
+            if((dir = open_parent(ctx)) == -1){
+                return -1;
+            }
+            for(int attempt = 0;fd < 0 && attempt < TEMP_ATTEMPTS;attempt++){
+                if((temp = temp_name(ctx, stat_buf.st_ino, attempt)) == NULL){
+                    break;
+                }
+                fd = openat(dir, temp, O_WRONLY | O_CREAT | O_EXCL, create_mode);
+                if(fd < 0 && errno != EEXIST){
+                    break;
+                }
+            }
+        }else{
+            fd = open(ctx->path_buf, O_WRONLY | O_CREAT | O_TRUNC, create_mode);
+        }
+        if(fd < 0){
+            if(dir >= 0){
+                close(dir);
+            }
+            return -1;
+        }
+        ctx->stats.files++;
+        ctx->stats.bytes += size;
+    }else if(ctx->skip != NULL){
+        //Skipping the data of a replayed shard without reading it
+        n = ctx->io_len - ctx->io_pos;
+        if(n > size){
+            n = size;
+        }
+        ctx->io_pos += n;
+        size -= n;
+        if(size && ctx->skip(ctx->io_arg, size)){
+            return -1;
+        }
+        size = 0;
+    }
+    while(size > 0){
+        if(ctx->io_pos == ctx->io_len && fill_input(ctx)){
+            break;
+        }
+        n = ctx->io_len - ctx->io_pos;
+        if(n > size){
+            n = size;
+        }
+        if(fd >= 0){
+            written = write(fd, ctx->io_buf + ctx->io_pos, n);
+            if(written < 0 && errno == EINTR){
+                continue;
+            }
+            if(written <= 0){
+                break;
+            }
+            n = written;
+        }
+        ctx->io_pos += n;
+        size -= n;
+    }
+    if(fd < 0){
+        return size ? -1 : 0;
+    }
+    if(size){
+        //The data ended early, a partial temporary file must not replace anything
+        close(fd);
+        if(temp != NULL){
+            unlinkat(dir, temp, 0);
+        }
+        if(dir >= 0){
+            close(dir);
+        }
+        return -1;
+    }
+    return finish_file(ctx, fd, mode, dir, temp);
+}
+
+/*
+ * @brief Deserialize directory contents into a directory and give it its mode.
+ * @details  This is transplant_deserialize_directory(), with the mode of the
+ * directory applied at END_OF_DIRECTORY, once all its entries exist and
+ * before the directory is synced, so that the sync covers the mode.  Shard
+ * children keep the directory writable by its owner, since other shards may
+ * still be creating entries in it.
+ *
+ * @param depth  The value of the depth field expected in the records.
+ * @param mode  The mode from the DIRECTORY_ENTRY record, or 0 to leave the
+ * mode of the directory alone.
+ * @return 0 in case of success, -1 otherwise.
+ */
+static int deserialize_directory(struct transplant_ctx *ctx, int depth, mode_t mode) {
+    struct stat stat_buf;
+    int type;
+    uint32_t record_depth;
+    uint64_t size;
+    uint64_t file_mode;
+    uint64_t file_size;
+    uint64_t name_length;
+    int changed = 0;
+    int c;
+
+    if(mkdir(ctx->path_buf, 0700) && errno != EEXIST){
+        return -1;
+    }
+    if(!ctx->shard_fixup){
+        ctx->stats.directories++;
+    }
+
+    //Checking for START_OF_DIRECTORY record for deserializing a directory
+    if(get_header(ctx, &type, &record_depth, &size)){
+        return -1;
+    }
+    if(type != TRANSPLANT_START_OF_DIRECTORY || record_depth != (uint32_t) depth){
+        return -1;
+    }
+
+    while(1){
+        if(get_header(ctx, &type, &record_depth, &size) || record_depth != (uint32_t) depth){
+            return -1;
+        }
+        if(type == TRANSPLANT_END_OF_DIRECTORY){
+            if(mode && ctx->shard_index >= 0 && !ctx->shard_fixup){
+                mode |= 0700;
+            }
+            if(mode && chmod(ctx->path_buf, mode & 0777)){
+                return -1;
+            }
+            return sync_directory(ctx, changed || mode);
+        }
+        if(type != TRANSPLANT_DIRECTORY_ENTRY || size < TRANSPLANT_HEADER_SIZE + ENTRY_METADATA_SIZE){
+            return -1;
+        }
+        if(get_number(ctx, 4, &file_mode) || get_number(ctx, 8, &file_size)){
+            return -1;
+        }
+
+        //Loading the entry name into name_buf
+        name_length = size - TRANSPLANT_HEADER_SIZE - ENTRY_METADATA_SIZE;
+        if(name_length >= ctx->name_size){
+            return -1;
+        }
+        for(uint64_t i = 0;i<name_length;i++){
+            if((c = get_byte(ctx)) < 0){
+                return -1;
+            }
+            *(ctx->name_buf+i) = c;
+        }
+        *(ctx->name_buf+name_length) = '\0';
+        if(transplant_path_push(ctx, ctx->name_buf)){
+            return -1;
+        }
+
+        //If clobber is not set and file exists returning -1; the shards of one
+        //archive all carry the same directories, so those may already exist
+        if(!(ctx->options & TRANSPLANT_CLOBBER) && !ctx->shard_fixup
+            && !(ctx->shard_index >= 0 && S_ISDIR(file_mode))
+            && !stat(ctx->path_buf, &stat_buf)){
+            return -1;
+        }
+
+        //Deserializing based on a file record and directory record
+        if(S_ISREG(file_mode)){
+            if(transplant_deserialize_file(ctx, depth, file_mode)){
+                return -1;
+            }
+        }else if(S_ISDIR(file_mode)){
+            if(deserialize_directory(ctx, depth+1, file_mode)){
+                return -1;
+            }
+        }
+
+        //Counting what the durability mode has to sync; a replayed shard only
+        //changes the modes of directories
+        if(!ctx->shard_fixup || S_ISDIR(file_mode)){
+            changed++;
+            ctx->unsynced++;
+        }
+        transplant_path_pop(ctx);
+    }
+}
+
+/*
+ * @brief Deserialize directory contents into the directory named by the path
+ * of a context.
+ * @details  The directory is created if it does not exist.  A sequence of
+ * DIRECTORY_ENTRY records bracketed by START_OF_DIRECTORY and END_OF_DIRECTORY
+ * records at the given depth is read from the source and the entries are
+ * recreated within the directory.  Existing entries are an error unless the
+ * TRANSPLANT_CLOBBER option is set, except for directories when sharding,
+ * since every shard carries the same directories.  At END_OF_DIRECTORY the
+ * new entries are synced as the durability mode of the context requires.
+ * The mode of the directory itself is left as it is.
+ *
+ * @param depth  The value of the depth field expected in the records.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int transplant_deserialize_directory(struct transplant_ctx *ctx, int depth) {
+    return deserialize_directory(ctx, depth, 0);
+}
+
+/*
+ * @brief Reconstruct a tree of files and directories from the source of a
+ * context.
+ * @details  The tree is placed in the directory named by the path of the
+ * context, which is created if it does not exist.  The data read must be in
+ * the format produced by transplant_serialize().
+ *
+ * @return 0 in case of success, -1 otherwise.
+ */
+int transplant_deserialize(struct transplant_ctx *ctx) {
+    int type;
+    uint32_t depth;
+    uint64_t size;
+
+    if(get_header(ctx, &type, &depth, &size) || type != TRANSPLANT_START_OF_TRANSMISSION){
+        return -1;
+    }
+    if(transplant_deserialize_directory(ctx, 1)){
+        return -1;
+    }
+    if(get_header(ctx, &type, &depth, &size) || type != TRANSPLANT_END_OF_TRANSMISSION){
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief Add up the sizes of the regular files in a tree.
+ * @details  The tree rooted at the directory named by the path of the context
+ * is traversed the same way transplant_serialize_directory() does it.  This
+ * is used to set shard_total before serializing a sharded archive: with
+ * shard_count shards and shard_index set to the shard wanted, each regular
+ * file is assigned to the shard whose slice of shard_total bytes contains the
+ * middle of the file in traversal order.
+ *
+ * @param total  Incremented by the size of every regular file found.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int transplant_tree_size(struct transplant_ctx *ctx, uint64_t *total) {
+    struct stat stat_buf;
+    struct dirent *de;
+    int exit = 0;
+    DIR *dir = opendir(ctx->path_buf);
+    if(dir == NULL){
+        return -1;
+    }
+    while(!exit && (de = readdir(dir)) != NULL){
+        if(is_dot_entry(de->d_name)){
+            continue;
+        }
+        if(transplant_path_push(ctx, de->d_name) || stat(ctx->path_buf, &stat_buf)){
+            exit = -1;
+            break;
+        }
+        if(S_ISREG(stat_buf.st_mode)){
+            *total += stat_buf.st_size;
+        }else if(S_ISDIR(stat_buf.st_mode)){
+            exit = transplant_tree_size(ctx, total);
+        }
+        transplant_path_pop(ctx);
+    }
+    closedir(dir);
+    return exit;
+}
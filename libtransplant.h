@@ -0,0 +1,155 @@
+#ifndef LIBTRANSPLANT_H
+#define LIBTRANSPLANT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Embeddable interface to the transplant serializer.
+ *
+ * All the state of a run lives in a struct transplant_ctx, together with
+ * pointers to storage supplied by the caller, so that independent trees can
+ * be serialized or deserialized concurrently in one process, one context per
+ * thread.  The library never allocates memory.  Serialized data is produced
+ * to a sink callback and consumed from a source callback supplied by the
+ * caller (see transplant_io below).  Record headers and file data are staged in the caller's io
+ * buffer: file content is read straight into it and handed to the sink from
+ * there, and on the way back it is written to disk straight out of it.
+ */
+
+/*
+ * Format of the serialized stream.
+ */
+#define TRANSPLANT_MAGIC0 0x0C
+#define TRANSPLANT_MAGIC1 0x0D
+#define TRANSPLANT_MAGIC2 0xED
+
+#define TRANSPLANT_START_OF_TRANSMISSION 0
+#define TRANSPLANT_END_OF_TRANSMISSION 1
+#define TRANSPLANT_START_OF_DIRECTORY 2
+#define TRANSPLANT_END_OF_DIRECTORY 3
+#define TRANSPLANT_DIRECTORY_ENTRY 4
+#define TRANSPLANT_FILE_DATA 5
+
+#define TRANSPLANT_HEADER_SIZE 16
+
+/*
+ * Bits of the options field.  These have the same values as the
+ * corresponding bits of global_options in the command-line program.
+ */
+#define TRANSPLANT_CLOBBER 0x08
+
+/*
+ * Durability modes for deserialization.
+ * TRANSPLANT_DURABLE_NONE: files are just closed; the data reaches the disk
+ * whenever the kernel writes it back.
+ * TRANSPLANT_DURABLE_BATCHED: writeback of each file is started with
+ * sync_file_range() as soon as it is complete, and one syncfs() per directory
+ * waits for it at END_OF_DIRECTORY if anything was written since the last one.
+ * TRANSPLANT_DURABLE_STRICT: each file is created with its mode and synced
+ * with fdatasync() before it is closed, or with fsync() if the umask forced
+ * a chmod afterwards (fdatasync() does not flush that), an existing file is
+ * replaced atomically by writing a new temporary file and renaming it over
+ * the original, and each directory that gained or replaced entries or had
+ * its mode set is fsync()ed at END_OF_DIRECTORY, after its mode is applied.
+ */
+#define TRANSPLANT_DURABLE_NONE 0
+#define TRANSPLANT_DURABLE_BATCHED 1
+#define TRANSPLANT_DURABLE_STRICT 2
+
+/*
+ * Smallest io buffer accepted by transplant_init().
+ */
+#define TRANSPLANT_IO_MIN 64
+
+/*
+ * Source and sink callbacks.  They are called with the io_arg field of the
+ * context as first argument, so a descriptor always needs a small wrapper
+ * that passes the iovec on to readv() or writev().  They return the number
+ * of bytes transferred, 0 at end of input, or -1 with errno set on error.
+ * Short transfers are retried by the library.  Everything is staged
+ * contiguously in the io buffer, so iovcnt is always 1: one call carries a
+ * batch of records, as many as fit in the io buffer.  The iovec parameter
+ * leaves room for scattered batches without changing the signature.
+ */
+typedef ssize_t (*transplant_io)(void *arg, const struct iovec *iov, int iovcnt);
+
+/*
+ * Optional skip callback, called with io_arg to discard the next count bytes
+ * of the source without reading them, for example with lseek().  It returns
+ * 0 in case of success and -1 otherwise.  It is only used to skip file data
+ * when replaying a shard; without it that data is read and thrown away.
+ */
+typedef int (*transplant_skip)(void *arg, uint64_t count);
+
+/*
+ * Counters accumulated by a context, zeroed by transplant_init().  The sync
+ * counters and sync_nsec, the time spent in those calls, show the cost of
+ * the durability mode.
+ */
+struct transplant_stats {
+    uint64_t files;
+    uint64_t directories;
+    uint64_t bytes;
+    uint64_t writebacks;
+    uint64_t fdatasyncs;
+    uint64_t fsyncs;
+    uint64_t syncfs;
+    uint64_t directory_fsyncs;
+    uint64_t renames;
+    uint64_t sync_nsec;
+};
+
+struct transplant_ctx {
+    // Storage supplied to transplant_init()
+    char *path_buf;
+    size_t path_size;
+    int path_length;
+    char *name_buf;
+    size_t name_size;
+    char *io_buf;
+    size_t io_size;
+    size_t io_pos;
+    size_t io_len;
+
+    // Set by the caller before serializing or deserializing
+    int options;
+    transplant_io source;
+    transplant_io sink;
+    transplant_skip skip;
+    void *io_arg;
+    int durability;
+
+    // Sharding, see transplant_tree_size()
+    int shard_count;
+    int shard_index;
+    uint64_t shard_total;
+    uint64_t shard_offset;
+    int shard_fixup;
+
+    // Statistics and durability bookkeeping
+    struct transplant_stats stats;
+    uint64_t unsynced;
+};
+
+int transplant_init(struct transplant_ctx *ctx, char *path_buf, size_t path_size,
+    char *name_buf, size_t name_size, char *io_buf, size_t io_size);
+
+int transplant_path_init(struct transplant_ctx *ctx, char *name);
+int transplant_path_push(struct transplant_ctx *ctx, char *name);
+int transplant_path_pop(struct transplant_ctx *ctx);
+
+int transplant_serialize(struct transplant_ctx *ctx);
+int transplant_serialize_directory(struct transplant_ctx *ctx, int depth);
+int transplant_serialize_file(struct transplant_ctx *ctx, int depth, off_t size);
+int transplant_flush(struct transplant_ctx *ctx);
+
+int transplant_deserialize(struct transplant_ctx *ctx);
+int transplant_deserialize_directory(struct transplant_ctx *ctx, int depth);
+int transplant_deserialize_file(struct transplant_ctx *ctx, int depth, mode_t mode);
+
+int transplant_tree_size(struct transplant_ctx *ctx, uint64_t *total);
+
+#endif
@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pipeline.h"
+#include "debug.h"
+
+/*
+ * The pipeline interposes a kernel pipe between the process and the real
+ * standard input (or output).  A pump thread moves data between the real
+ * descriptor and the pipe with splice(), so the pipe buffer itself serves as
+ * the ring of buffers: its capacity is set to the requested ring size, a full
+ * ring blocks the producer and an empty ring blocks the consumer.  No data
+ * ever passes through user space in the pump, so no storage is needed here.
+ */
+
+/*
+ * Everything the pump thread needs is in its job, filled in before the thread
+ * is created and never written afterwards.  There is one job per direction:
+ * the input pump is detached and may outlive its pipeline, so an input
+ * pipeline is started at most once per process and its job is never reused.
+ */
+struct pump_job {
+    int input;      // 1 if the pump feeds the standard input
+    int in;         // Descriptor the pump splices from
+    int out;        // Descriptor the pump splices to
+    size_t chunk;   // Largest amount moved by a single splice()
+};
+
+static struct pump_job input_job;
+static struct pump_job output_job;
+static int input_started = 0;
+
+static int pipeline_fd = -1;    // Descriptor (0 or 1) that has been redirected
+static int outer_fd = -1;       // Duplicate of the original descriptor
+static pthread_t pump_thread;
+
+struct pipe_ends {
+    int read_end;
+    int write_end;
+};
+
+/*
+ * @brief Body of the pump thread.
+ * @details Splices data from the in descriptor of its job to the out
+ * descriptor until end of file or an error, then closes both, so that the
+ * other side of the internal pipe sees end of file (or EPIPE, if it is the
+ * reader that went away).  SIGPIPE is blocked so that a consumer which stops
+ * early shows up as an EPIPE error instead of killing the process.
+ * @param arg  The struct pump_job describing the transfer.
+ * @return 0 cast to a pointer in case of success, -1 in case of an error.
+ */
+static void *pump(void *arg) {
+    const struct pump_job *job = arg;
+    intptr_t status = 0;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while(1){
+        ssize_t n = splice(job->in, NULL, job->out, NULL, job->chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(n == 0){
+            break;
+        }
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            //The main thread stopped reading, whatever is left is not needed
+            if(errno == EPIPE && job->input){
+                break;
+            }
+            debug("Pipeline pump failed with errno %d", errno);
+            status = -1;
+            break;
+        }
+    }
+
+    close(job->in);
+    close(job->out);
+    return (void *) status;
+}
+
+/*
+ * @brief Checks whether splice() can be used on the given descriptor.
+ * @details splice() needs a pipe on one side; the other side may be a pipe,
+ * a socket or a regular file.  Terminals and other devices are not handled,
+ * and neither are files opened with O_APPEND, which splice() refuses to
+ * write to.
+ * @return 1 if the descriptor can be spliced, 0 otherwise.
+ */
+static int can_splice(int fd) {
+    struct stat stat_buf;
+    int flags = fcntl(fd, F_GETFL);
+    if(flags < 0 || (flags & O_APPEND) || fstat(fd, &stat_buf)){
+        return 0;
+    }
+    return S_ISFIFO(stat_buf.st_mode) || S_ISSOCK(stat_buf.st_mode) || S_ISREG(stat_buf.st_mode);
+}
+
+/*
+ * @brief Read the largest pipe size an unprivileged process may request.
+ * @return the value of fs.pipe-max-size, or -1 if it cannot be read.
+ */
+static int pipe_max_size() {
+    int size = -1;
+    FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if(f == NULL){
+        return -1;
+    }
+    if(fscanf(f, "%d", &size) != 1){
+        size = -1;
+    }
+    fclose(f);
+    return size;
+}
+
+/*
+ * @brief Start a pipeline on the standard input or standard output.
+ * @details  For fd 0, a pump thread reads the real standard input ahead of
+ * the main thread and fills the ring, so that a bursty upstream is not
+ * stalled by slow disk writes.  For fd 1, the main thread writes into the
+ * ring and the pump thread drains it to the real standard output, so that
+ * file reads overlap with output writes.  This function must be called
+ * before any stdio function has touched the descriptor.  If the descriptor
+ * cannot be spliced, the pipeline is not started and processing proceeds
+ * in lockstep as usual.
+ *
+ * @param fd  Either 0 (standard input) or 1 (standard output).
+ * @param ring_size  Requested ring capacity in bytes.  The kernel rounds it
+ * up to a power-of-two number of pages.  Unprivileged processes may not exceed
+ * fs.pipe-max-size; a larger request is reduced to that limit with a warning.
+ * @return 0 if the pipeline was started or skipped, -1 in case of an error.
+ */
+int pipeline_start(int fd, size_t ring_size) {
+    struct pipe_ends ends;
+    struct pump_job *job = fd == 0 ? &input_job : &output_job;
+
+    if(pipeline_fd != -1 || (fd != 0 && fd != 1) || (fd == 0 && input_started)){
+        return -1;
+    }
+    if(!can_splice(fd)){
+        debug("Descriptor %d cannot be spliced, pipeline disabled", fd);
+        return 0;
+    }
+    if(pipe((int *) &ends)){
+        return -1;
+    }
+
+    //Growing the pipe to the ring size, retrying with the largest size the
+    //kernel grants to unprivileged processes if it is refused
+    int size = fcntl(ends.write_end, F_SETPIPE_SZ, (int) ring_size);
+    if(size < 0 && errno == EPERM){
+        int max = pipe_max_size();
+        if(max > 0){
+            fprintf(stderr, "transplant: ring size reduced from %lu to fs.pipe-max-size (%d bytes)\n",
+                (unsigned long) ring_size, max);
+            size = fcntl(ends.write_end, F_SETPIPE_SZ, max);
+        }
+    }
+    if(size < 0){
+        size = fcntl(ends.write_end, F_GETPIPE_SZ);
+        fprintf(stderr, "transplant: cannot set the ring size, using %d bytes\n", size);
+    }
+    debug("Pipeline on fd %d with a %d byte ring", fd, size);
+
+    int outer = dup(fd);
+    int pump_end = dup(fd == 0 ? ends.write_end : ends.read_end);
+    if(outer < 0 || pump_end < 0){
+        if(outer >= 0){
+            close(outer);
+        }
+        if(pump_end >= 0){
+            close(pump_end);
+        }
+        close(ends.read_end);
+        close(ends.write_end);
+        return -1;
+    }
+
+    //Putting the pipe in place of the descriptor, the pump gets its own
+    //duplicates of the other end and of the original descriptor
+    dup2(fd == 0 ? ends.read_end : ends.write_end, fd);
+    close(ends.read_end);
+    close(ends.write_end);
+    job->input = fd == 0;
+    job->in = fd == 0 ? dup(outer) : pump_end;
+    job->out = fd == 0 ? pump_end : dup(outer);
+    job->chunk = size > 0 ? (size_t) size : ring_size;
+    if(job->in < 0 || job->out < 0 || pthread_create(&pump_thread, NULL, pump, job)){
+        dup2(outer, fd);
+        close(outer);
+        close(pump_end);
+        if(job->in >= 0 && job->in != pump_end){
+            close(job->in);
+        }
+        if(job->out >= 0 && job->out != pump_end){
+            close(job->out);
+        }
+        return -1;
+    }
+    if(fd == 0){
+        input_started = 1;
+    }
+    pipeline_fd = fd;
+    outer_fd = outer;
+    return 0;
+}
+
+/*
+ * @brief Stop the pipeline and restore the original descriptor.
+ * @details  For the output side, pending stdio data is flushed into the ring
+ * and the ring is drained completely before returning.  For the input side,
+ * any data left unread in the ring is discarded and the pump thread is
+ * detached; it closes its own descriptors when it runs down.  In both cases
+ * the original descriptor is put back in place.  Calling this function when
+ * no pipeline is running has no effect.
+ *
+ * @return 0 in case of success, -1 if the pump thread hit an I/O error while
+ * draining the ring to the standard output.
+ */
+int pipeline_finish() {
+    void *status = NULL;
+
+    if(pipeline_fd == -1){
+        return 0;
+    }
+    if(pipeline_fd == 1){
+        fflush(stdout);
+    }
+
+    //Replacing our end of the pipe wakes the pump with EOF or EPIPE
+    dup2(outer_fd, pipeline_fd);
+    close(outer_fd);
+    outer_fd = -1;
+    if(pipeline_fd == 0){
+        //The pump may be blocked on an upstream that never closes, so it is
+        //left to run down on its own; the transmission has been fully read
+        pthread_detach(pump_thread);
+        pipeline_fd = -1;
+        return 0;
+    }
+    pipeline_fd = -1;
+    pthread_join(pump_thread, &status);
+    return (intptr_t) status == 0 ? 0 : -1;
+}
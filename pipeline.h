@@ -0,0 +1,14 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+
+/*
+ * Producer/consumer pipeline that decouples the standard input or standard
+ * output of the process from the record processing done on the main thread.
+ */
+
+int pipeline_start(int fd, size_t ring_size);
+int pipeline_finish();
+
+#endif
@@ -2,7 +2,14 @@
 #include "transplant.h"
 #include "debug.h"
 #include "helper.h"
+#include "pipeline.h"
+#include "libtransplant.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 
 #ifdef _STRING_H
 #error "Do not #include <string.h>. You will get a ZERO."
@@ -31,7 +38,60 @@
  * IMPORTANT: You MAY NOT use floating point arithmetic or declare
  * any "float" or "double" variables.  IF YOU VIOLATE THIS RESTRICTION,
  * YOU WILL GET A ZERO!
+ *
+ * EXCEPTION: the io buffer of the command-line context (see cli_ctx()) is
+ * one anonymous mmap() of CLI_IO_SIZE bytes, made once and never freed.
+ * It is storage allocated outside of const.h and is allowed only for this
+ * buffer; nothing else in this file or in libtransplant allocates storage.
+ */
+
+/*
+ * Size in bytes of the ring used by the stdin/stdout pipeline, as set by the
+ * -b option.  Zero means that records are read and written in lockstep.
+ */
+static size_t ring_size = 0;
+
+/*
+ * Largest ring size, in kilobytes, accepted for the -b option.  This only
+ * keeps the size in bytes within an int, as F_SETPIPE_SZ takes; the limit the
+ * kernel actually grants is applied by pipeline_start().
+ */
+#define RING_KBYTES_MAX (1024 * 1024)
+
+/*
+ * Durability mode of deserialization, as set by the -f option, and whether
+ * statistics are printed to stderr at the end of a run, as set by -v.
+ */
+static int durability = TRANSPLANT_DURABLE_NONE;
+static int verbose = 0;
+
+/*
+ * Shard files named on the command line by the -o and -i options.  shard_count
+ * is zero if the archive is a single stream on stdin/stdout.  The state of a
+ * sharded run itself is kept in the context, see run_shards().
  */
+static int shard_count = 0;
+static int shard_argc = 0;
+static char **shard_argv = NULL;
+
+/*
+ * Largest number of shards accepted on the command line.
+ */
+#define SHARDS_MAX 64
+
+/*
+ * Size of the io buffer of the command-line context.
+ */
+#define CLI_IO_SIZE (128*1024)
+
+/*
+ * The command-line program is a client of libtransplant like any other: its
+ * context works on path_buf and name_buf from const.h and on the standard
+ * input and output.  Its io buffer is the one allocation allowed by the
+ * exception stated at the top of this file.
+ */
+static struct transplant_ctx cli;
+static int cli_ready = 0;
 
 /*
  * A function that returns printable names for the record types, for use in
@@ -56,6 +116,48 @@ static char *record_type_name(int i) {
     }
 }
 
+static ssize_t stdin_source(void *arg, const struct iovec *iov, int iovcnt) {
+    (void) arg;
+    return readv(STDIN_FILENO, iov, iovcnt);
+}
+
+static ssize_t stdout_sink(void *arg, const struct iovec *iov, int iovcnt) {
+    (void) arg;
+    return writev(STDOUT_FILENO, iov, iovcnt);
+}
+
+static int stdin_skip(void *arg, uint64_t count) {
+    (void) arg;
+    return lseek(STDIN_FILENO, count, SEEK_CUR) < 0 ? -1 : 0;
+}
+
+/*
+ * @brief Return the context of the command-line program.
+ * @details  The context is set up on first use.  Its options are refreshed
+ * from global_options on every call.
+ * @return a pointer to the context, or NULL if it could not be set up.
+ */
+static struct transplant_ctx *cli_ctx() {
+    char *io_buf;
+    if(!cli_ready){
+        io_buf = mmap(NULL, CLI_IO_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(io_buf == MAP_FAILED){
+            return NULL;
+        }
+        if(transplant_init(&cli, path_buf, sizeof(path_buf), name_buf, sizeof(name_buf), io_buf, CLI_IO_SIZE)){
+            munmap(io_buf, CLI_IO_SIZE);
+            return NULL;
+        }
+        cli.source = stdin_source;
+        cli.sink = stdout_sink;
+        cli.skip = stdin_skip;
+        cli_ready = 1;
+    }
+    cli.options = global_options;
+    cli.durability = durability;
+    return &cli;
+}
+
 /*
  * @brief  Initialize path_buf to a specified base path.
  * @details  This function copies its null-terminated argument string into
@@ -69,25 +171,13 @@ static char *record_type_name(int i) {
  * @return 0 on success, -1 in case of error
  */
 int path_init(char *name) {
-    // To be implemented
-    int i = 0;
-    int length = sizeof(path_buf)/sizeof(char);
-    path_length = -1;
-    while((*(name+i)) != '\0' && (i<length)){
-        path_length++;
-        *(path_buf+path_length) = *(name+i);
-        i++;
-    }
-
-    // if(*(path_buf+path_length) != '/'){
-    //     path_length++;
-    //     *(path_buf+path_length) = '/';
-    // }
-
-    if(i>=(length)){
+    struct transplant_ctx *ctx = cli_ctx();
+    if(ctx == NULL){
         return -1;
     }
-    return 0;
+    int ret = transplant_path_init(ctx, name);
+    path_length = ctx->path_length;
+    return ret;
 }
 
 /*
@@ -104,32 +194,13 @@ int path_init(char *name) {
  * @return 0 in case of success, -1 otherwise.
  */
 int path_push(char *name) {
-    // To be implemented.
-    int i = 0;
-    if(*(name) == '\0'){
-        return 0;
-    }
-
-    //Appending '/' if current path_buf doesn't have it as it's last character
-    if(*(path_buf+path_length) != '/'){
-        path_length++;
-        *(path_buf+path_length) = '/';
-    }
-
-    int length = sizeof(path_buf)/sizeof(char);
-    while(*(name+i) != '\0'  && i<length){
-        path_length++;
-        if(*(name+i) == '/'){
-            return -1;
-        }
-        *(path_buf+path_length) = *(name+i);
-        i++;
-    }
-
-    if(i>=(length)){
+    struct transplant_ctx *ctx = cli_ctx();
+    if(ctx == NULL){
         return -1;
     }
-    return 0;
+    int ret = transplant_path_push(ctx, name);
+    path_length = ctx->path_length;
+    return ret;
 }
 
 /*
@@ -145,20 +216,13 @@ int path_push(char *name) {
  * @return 0 in case of success, -1 otherwise.
  */
 int path_pop() {
-    // To be implemented.
-    if(!path_length){
+    struct transplant_ctx *ctx = cli_ctx();
+    if(ctx == NULL){
         return -1;
     }
-    while(*(path_buf+path_length) != '/' && path_length>=0){
-        *(path_buf+path_length) = '\0';
-        path_length--;
-    }
-
-    if(*(path_buf+path_length) == '/'){
-        *(path_buf+path_length) = '\0';
-        path_length--;
-    }
-    return 0;
+    int ret = transplant_path_pop(ctx);
+    path_length = ctx->path_length;
+    return ret;
 }
 
 /*
@@ -179,80 +243,11 @@ int path_pop() {
  * directories.
  */
 int deserialize_directory(int depth) {
-    // To be implemented.
-    uint32_t record_depth = 0;
-    uint64_t size = 0;
-    uint32_t file_mode = 0;
-    int name_length = 0;
-    char record_type = 0;
-    int exit = -1;
-
-    if(mkdir(path_buf,0700) && errno!= EEXIST){
+    struct transplant_ctx *ctx = cli_ctx();
+    if(ctx == NULL){
         return -1;
     }
-
-    if(read_magic_bytes()){
-        return -1;
-    }
-
-    record_type = getchar();
-    record_depth = get_record_depth();
-    size = get_record_size();
-    struct stat stat_buf;
-
-    //Checking for START_OF_DIRECTORY record for deserializing a directory
-    if(record_type != START_OF_DIRECTORY || record_depth != depth){
-        return -1;
-    }
-
-    //Magic bytes check for DIRECTORY_ENTRY record
-    if(read_magic_bytes()){
-        return -1;
-    }
-
-    record_type = getchar();
-    while(record_type != END_OF_DIRECTORY && record_type == DIRECTORY_ENTRY){
-        record_depth = get_record_depth();
-        size = get_record_size();
-        file_mode = get_record_depth();
-        uint64_t file_size = get_record_size();
-        name_length = size-12-HEADER_SIZE;
-        set_name_buf(name_length);
-        path_push(name_buf);
-
-        //If clobber is not set and file exists returning -1
-        if(!(global_options&0x08) && !stat(path_buf,&stat_buf)){
-            return -1;
-        }
-
-        //Deserializing based on a file record and directory record
-        if(S_ISREG(file_mode)){
-            if(deserialize_file(depth)){
-                return -1;
-            }
-            chmod(path_buf,file_mode & 0777);
-            path_pop();
-        }else if(S_ISDIR(file_mode)){
-            if(deserialize_directory(depth+1)){
-                return -1;
-            }
-            chmod(path_buf,file_mode & 0777);
-            path_pop();
-        }
-
-        if(read_magic_bytes()){
-            return -1;
-        }
-        record_type = getchar();
-    }
-
-    //Checking for the END_OF_DIRECTORY record
-    record_depth = get_record_depth();
-    size = get_record_size();
-    if(record_type != END_OF_DIRECTORY || record_depth != depth){
-        return -1;
-    }
-    return 0;
+    return transplant_deserialize_directory(ctx, depth);
 }
 
 /*
@@ -273,30 +268,181 @@ int deserialize_directory(int depth) {
  * deserialized file.
  */
 int deserialize_file(int depth){
-    //Reading magic bytes from stdin for FILE_DATA
-    if(read_magic_bytes()){
+    struct transplant_ctx *ctx = cli_ctx();
+    if(ctx == NULL){
         return -1;
     }
+    return transplant_deserialize_file(ctx, depth, 0);
+}
 
-    uint64_t i = 0;
-    char record_type = getchar();
-    uint32_t record_depth = get_record_depth();
-    uint64_t size = get_record_size()-16;
+/*
+ * @brief Print the statistics of a run to stderr.
+ * @details  Besides the amount of data processed, this shows the number of
+ * each kind of sync call issued for the durability mode and the time spent
+ * in them, which is the cost of the mode.  Each shard reports separately.
+ */
+static void print_stats(struct transplant_ctx *ctx) {
+    struct transplant_stats *stats = &ctx->stats;
+    char *mode = "none";
+    if(ctx->durability == TRANSPLANT_DURABLE_BATCHED){
+        mode = "batched";
+    }else if(ctx->durability == TRANSPLANT_DURABLE_STRICT){
+        mode = "strict";
+    }
 
-    //Checking whether record is of type FILE_DATA and record depth matches with expected depth
-    if(record_type == FILE_DATA && depth == record_depth){
-        FILE *f = fopen(path_buf,"w");
-        if(f==NULL && errno){
+    if(ctx->shard_fixup){
+        fprintf(stderr, "modes: ");
+    }else if(ctx->shard_index >= 0){
+        fprintf(stderr, "shard %d: ", ctx->shard_index);
+    }
+    fprintf(stderr, "%lu files, %lu directories, %lu bytes; durability %s: "
+        "%lu writebacks, %lu fdatasyncs, %lu fsyncs, %lu syncfs, %lu directory fsyncs, %lu renames, "
+        "%lu us in sync calls\n",
+        (unsigned long) stats->files, (unsigned long) stats->directories,
+        (unsigned long) stats->bytes, mode,
+        (unsigned long) stats->writebacks, (unsigned long) stats->fdatasyncs,
+        (unsigned long) stats->fsyncs,
+        (unsigned long) stats->syncfs, (unsigned long) stats->directory_fsyncs,
+        (unsigned long) stats->renames, (unsigned long) (stats->sync_nsec / 1000));
+}
+
+/*
+ * @brief Return the name of a shard file given on the command line.
+ * @details  Shard files are named by the arguments of the -o (serialize) or
+ * -i (deserialize) options, numbered from 0 in the order they appear.
+ *
+ * @param index  The number of the shard.
+ * @return the pathname of the shard file, or NULL if there is no such shard.
+ */
+static char *shard_path(int index) {
+    char *arg;
+    for(int i = 2;i+1<shard_argc;i++){
+        arg = *(shard_argv+i);
+        if(!compare_strings(arg,"-o") || !compare_strings(arg,"-i")){
+            if(!index){
+                return *(shard_argv+i+1);
+            }
+            index--;
+            i++;
+        }else if(!compare_strings(arg,"-p") || !compare_strings(arg,"-b")
+            || !compare_strings(arg,"-f")){
+            i++;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * @brief Open a file in place of the standard input or standard output.
+ * @return 0 in case of success, -1 otherwise.
+ */
+static int redirect(char *name, int fd) {
+    int file = fd ? open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666) : open(name, O_RDONLY);
+    if(file < 0){
+        return -1;
+    }
+    if(file != fd && (dup2(file, fd) < 0 || close(file))){
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief Check that every shard input is a regular file.
+ * @details  The first shard is read twice, once by its child and once more
+ * by the parent to set the final directory modes, and its file data is
+ * skipped with lseek() the second time.  Pipes, process substitutions and
+ * other streams cannot be used, so they are rejected before anything is
+ * restored.
+ *
+ * @return 0 if all the shard inputs are seekable regular files, -1 otherwise.
+ */
+static int check_shard_inputs() {
+    struct stat stat_buf;
+    char *name;
+    for(int i = 0;i<shard_count;i++){
+        name = shard_path(i);
+        if(stat(name, &stat_buf)){
+            fprintf(stderr, "transplant: cannot access shard input %s\n", name);
             return -1;
         }
-        while(i<size){
-            fputc(getchar(),f);
-            i++;
+        if(!S_ISREG(stat_buf.st_mode)){
+            fprintf(stderr, "transplant: shard input %s is not a regular file; "
+                "-i needs seekable regular files\n", name);
+            return -1;
         }
-        fclose(f);
-        return 0;
-    }else
+    }
+    return 0;
+}
+
+/*
+ * @brief Serialize or deserialize all the shards of an archive concurrently.
+ * @details  One child process is forked per shard.  Each child redirects its
+ * standard output (or input) to its shard file and then runs serialize() (or
+ * deserialize()) on the tree in path_buf, limited to its own shard.  Since
+ * every shard carries the whole directory structure, deserializing children
+ * share parent directories through the existing-directory handling of
+ * transplant_deserialize_directory(); they keep directories writable by their
+ * owner and the final modes are applied afterwards from the first shard,
+ * which is why shard inputs must be seekable regular files.
+ * The tree must not change while it is being serialized, otherwise files may
+ * be assigned inconsistently.
+ *
+ * @param serializing  Nonzero to write shards, zero to read them.
+ * @return 0 if every shard was processed successfully, -1 otherwise.
+ */
+static int run_shards(struct transplant_ctx *ctx, int serializing) {
+    int status = 0;
+    int started = 0;
+    int failed = 0;
+    int ok = 0;
+
+    ctx->shard_count = shard_count;
+    ctx->shard_total = 0;
+    if(serializing && transplant_tree_size(ctx, &ctx->shard_total)){
+        return -1;
+    }
+    if(!serializing && check_shard_inputs()){
         return -1;
+    }
+    debug("Running %d shards over %lu bytes", shard_count, (unsigned long) ctx->shard_total);
+
+    fflush(stdout);
+    for(int i = 0;i<shard_count;i++){
+        pid_t pid = fork();
+        if(pid < 0){
+            failed = 1;
+            break;
+        }
+        if(pid == 0){
+            ctx->shard_index = i;
+            ctx->shard_offset = 0;
+            if(serializing){
+                ok = !redirect(shard_path(i), STDOUT_FILENO) && !serialize();
+            }else{
+                ok = !redirect(shard_path(i), STDIN_FILENO) && !deserialize();
+            }
+            exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        started++;
+    }
+
+    while(started > 0){
+        if(wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS){
+            failed = 1;
+        }
+        started--;
+    }
+
+    //Every shard carries all the directories, so the first one is replayed
+    //without its file data to give them their final modes
+    if(!serializing && !failed){
+        ctx->shard_index = 0;
+        ctx->shard_fixup = 1;
+        ring_size = 0;
+        failed = redirect(shard_path(0), STDIN_FILENO) || deserialize();
+    }
+    return failed ? -1 : 0;
 }
 
 /*
@@ -317,75 +463,14 @@ int deserialize_file(int depth){
  * that occur while reading file content and writing to standard output.
  */
 int serialize_directory(int depth) {
-    // To be implemented.
-
-    uint64_t size = 16;
-    int exit = -1;
-
-    //START_OF_DIRECTORY record for serializing a directory
-    write_record_header(START_OF_DIRECTORY, depth, size);
-
-    DIR *dir = opendir(path_buf);
-    struct dirent *de;
-    if(dir == NULL){
+    struct transplant_ctx *ctx = cli_ctx();
+    if(ctx == NULL){
         return -1;
     }
-    struct stat stat_buf;
-    int i=0;
-    char *name;
-    while((de = readdir(dir)) != NULL && !errno){
-        if(compare_strings(de->d_name,".") == -1 && compare_strings(de->d_name,"..") == -1){
-            i = 0;
-            path_push((de->d_name));
-            name = de->d_name;
-            stat(path_buf, &stat_buf);
-
-            //Finding the length of the file name
-            while(*(name+i) != '\0'){
-                i++;
-            }
-            size = 16+12+i;
-            i = 0;
-            // writing DIRECTORY_ENTRY record
-            write_record_header(4,depth, size);
-
-            // writing the mode of the file in directory entry record
-            putchar((stat_buf.st_mode >> 24) & 0xFF);
-            putchar((stat_buf.st_mode >> 16) & 0xFF);
-            putchar((stat_buf.st_mode >> 8) & 0xFF);
-            putchar((stat_buf.st_mode) & 0xFF);
-
-            //writing the size of the file in directory entry record
-            putchar((stat_buf.st_size >> 56) & 0xFF);
-            putchar((stat_buf.st_size >> 48) & 0xFF);
-            putchar((stat_buf.st_size >> 40) & 0xFF);
-            putchar((stat_buf.st_size >> 32) & 0xFF);
-            putchar((stat_buf.st_size >> 24) & 0xFF);
-            putchar((stat_buf.st_size >> 16) & 0xFF);
-            putchar((stat_buf.st_size >> 8) & 0xFF);
-            putchar((stat_buf.st_size) & 0xFF);
-
-            //writing the name of the file in directory entry record
-            while(*(name+i) != '\0'){
-                putchar(*(name+i));
-                i++;
-            }
-            if(S_ISREG(stat_buf.st_mode)){
-                exit = serialize_file(depth,stat_buf.st_size);
-            }else if(S_ISDIR(stat_buf.st_mode)){
-                exit = serialize_directory(depth+1);
-            }
-
-            if(exit !=0){
-                return -1;
-            }
-            path_pop();
-        }
+    if(transplant_serialize_directory(ctx, depth)){
+        return -1;
     }
-
-    //writing END_OF_DIRECTORY record for serializing a directory
-    write_record_header(END_OF_DIRECTORY, depth, HEADER_SIZE);
-    return 0;
+    return transplant_flush(ctx);
 }
 
 /*
@@ -402,23 +487,14 @@ int serialize_directory(int depth) {
  * from the file, and I/O errors reading the file data or writing to standard output.
  */
 int serialize_file(int depth, off_t size) {
-    // To be implemented.
-    FILE *f = fopen(path_buf, "r");
-    if(f==NULL && errno){
+    struct transplant_ctx *ctx = cli_ctx();
+    if(ctx == NULL){
         return -1;
     }
-    off_t i = 0;
-
-    uint64_t file_size = (uint64_t) size+16;
-
-    write_record_header(FILE_DATA,depth,file_size);
-    while(i<size){
-        putchar(fgetc(f));
-        i++;
+    if(transplant_serialize_file(ctx, depth, size)){
+        return -1;
     }
-
-    fclose(f);
-    return 0;
+    return transplant_flush(ctx);
 }
 
 /**
@@ -434,21 +510,31 @@ int serialize_file(int depth, off_t size) {
  * @return 0 if serialization completes without error, -1 if an error occurs.
  */
 int serialize() {
-    // To be implemented.
-    uint32_t depth = 0;
-    uint64_t size = 16;
-    int exit = -1;
+    struct transplant_ctx *ctx = cli_ctx();
+    if(ctx == NULL){
+        return -1;
+    }
 
-    //writing the START_OF_TRANSMISSION record
-    write_record_header(0,depth,size);
+    //Handing the work to one process per shard file
+    if(shard_count && ctx->shard_index < 0){
+        return run_shards(ctx, 1);
+    }
 
-    if(serialize_directory(1)){
+    //Overlapping file reads with stdout writes when a ring size was given
+    if(ring_size && pipeline_start(1, ring_size)){
         return -1;
     }
 
-    // Writing the END_OF_TRANSMISSION record
-    write_record_header(1, depth, size);
-
+    if(transplant_serialize(ctx)){
+        pipeline_finish();
+        return -1;
+    }
+    if(pipeline_finish()){
+        return -1;
+    }
+    if(verbose){
+        print_stats(ctx);
+    }
     return 0;
 }
 
@@ -466,27 +552,60 @@ int serialize() {
  * @return 0 if deserialization completes without error, -1 if an error occurs.
  */
 int deserialize() {
-    // To be implemented.
-    uint32_t depth = 0;
-    uint64_t size = 16;
-
-    //reading the START_OF_TRANSMISSION record
-    if(read_record_header()){
+    struct transplant_ctx *ctx = cli_ctx();
+    if(ctx == NULL){
         return -1;
     }
 
-    if(deserialize_directory(1)){
-        return -1;
+    //Handing the work to one process per shard file
+    if(shard_count && ctx->shard_index < 0){
+        return run_shards(ctx, 0);
     }
 
-    //reading the END_OF_TRANSMISSION record
-    if(read_record_header()){
+    //Reading stdin ahead of the disk writes when a ring size was given
+    if(ring_size && pipeline_start(0, ring_size)){
         return -1;
     }
 
+    if(transplant_deserialize(ctx)){
+        pipeline_finish();
+        return -1;
+    }
+    if(pipeline_finish()){
+        return -1;
+    }
+    if(verbose){
+        print_stats(ctx);
+    }
     return 0;
 }
 
+/*
+ * @brief Parse a ring size given in kilobytes.
+ * @details The argument must consist only of decimal digits and denote a
+ * value between 1 and RING_KBYTES_MAX.
+ *
+ * @param arg  The argument string to be parsed.
+ * @return the ring size in bytes, or 0 if the argument is not valid.
+ */
+static size_t parse_ring_size(char *arg) {
+    size_t kbytes = 0;
+    if(*arg == '\0'){
+        return 0;
+    }
+    while(*arg != '\0'){
+        if(*arg < '0' || *arg > '9'){
+            return 0;
+        }
+        kbytes = kbytes * 10 + (*arg - '0');
+        if(kbytes > RING_KBYTES_MAX){
+            return 0;
+        }
+        arg++;
+    }
+    return kbytes * 1024;
+}
+
 /**
  * @brief Validates command line arguments passed to the program.
  * @details This function will validate all the arguments passed to the
@@ -494,6 +613,9 @@ int deserialize() {
  * Upon successful return, the selected program options will be set in the
  * global variable "global_options", where they will be accessible
  * elsewhere in the program.
+ * After -s or -d the options may come in any order: -p DIR, -b KBYTES,
+ * -v, -o FILE (with -s, once per shard), and with -d also -c, -f MODE and
+ * -i FILE (once per shard; shard inputs must be seekable regular files).
  *
  * @param argc The number of arguments passed to the program from the CLI.
  * @param argv The argument strings passed to the program from the CLI.
@@ -505,7 +627,11 @@ int deserialize() {
  */
 int validargs(int argc, char **argv)
 {
-    // To be implemented.
+    int options = 0;
+    int durability_set = 0;
+    char *dir = NULL;
+    char *arg;
+
     if(argc == 1){
         return -1;
     }
@@ -516,40 +642,63 @@ int validargs(int argc, char **argv)
     }
 
     if(!compare_strings(*(argv+1),"-s")){
-        if(argc==2){
-            global_options = 2;
-            path_init(".");
-            return 0;
-        }else if(argc == 4 && !compare_strings(*(argv+2),"-p")){
-            global_options = 2;
-            path_init(*(argv+3));
-            return 0;
-        }
+        options = 0x02;
+    }else if(!compare_strings(*(argv+1),"-d")){
+        options = 0x04;
+    }else{
+        return -1;
     }
 
-    if(!compare_strings(*(argv+1),"-d")){
-        if(argc==2){
-            global_options = 4;
-            path_init(".");
-            return 0;
-        }else if(argc == 3 && !compare_strings(*(argv+2),"-c")){
-            global_options = 12;
-            path_init(".");
-            return 0;
-        }else if(argc == 4 && !compare_strings(*(argv+2),"-p") && compare_strings(*(argv+3),"-c")){
-            global_options = 4;
-            path_init(*(argv+3));
-            return 0;
-        }else if(argc == 5 && !compare_strings(*(argv+2),"-p") && !compare_strings(*(argv+4),"-c")){
-            global_options = 12;
-            path_init(*(argv+3));
-            return 0;
-        }else if(argc == 5 && !compare_strings(*(argv+2),"-c") && !compare_strings(*(argv+3),"-p")){
-            global_options = 12;
-            path_init(*(argv+4));
-            return 0;
+    //Remaining options may come in any order, each at most once
+    ring_size = 0;
+    shard_count = 0;
+    durability = TRANSPLANT_DURABLE_NONE;
+    verbose = 0;
+    for(int i = 2;i<argc;i++){
+        arg = *(argv+i);
+        if(!compare_strings(arg,"-p") && dir == NULL && i+1<argc
+            && compare_strings(*(argv+i+1),"-c")){
+            i++;
+            dir = *(argv+i);
+        }else if(!compare_strings(arg,"-c") && (options & 0x04) && !(options & 0x08)){
+            options |= 0x08;
+        }else if(!compare_strings(arg,"-b") && !ring_size && i+1<argc){
+            i++;
+            ring_size = parse_ring_size(*(argv+i));
+            if(!ring_size){
+                return -1;
+            }
+        }else if((!compare_strings(arg,"-o") && (options & 0x02))
+            || (!compare_strings(arg,"-i") && (options & 0x04))){
+            if(i+1>=argc || shard_count>=SHARDS_MAX){
+                return -1;
+            }
+            i++;
+            shard_count++;
+        }else if(!compare_strings(arg,"-f") && (options & 0x04) && !durability_set && i+1<argc){
+            i++;
+            durability_set = 1;
+            if(!compare_strings(*(argv+i),"none")){
+                durability = TRANSPLANT_DURABLE_NONE;
+            }else if(!compare_strings(*(argv+i),"batched")){
+                durability = TRANSPLANT_DURABLE_BATCHED;
+            }else if(!compare_strings(*(argv+i),"strict")){
+                durability = TRANSPLANT_DURABLE_STRICT;
+            }else{
+                return -1;
+            }
+        }else if(!compare_strings(arg,"-v") && !verbose){
+            verbose = 1;
+        }else{
+            return -1;
         }
     }
 
-    return -1;
+    if(path_init(dir == NULL ? "." : dir)){
+        return -1;
+    }
+    shard_argc = argc;
+    shard_argv = argv;
+    global_options = options;
+    return 0;
 }